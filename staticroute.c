@@ -12,10 +12,16 @@
 #include <sys/types.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <unistd.h>
 
 #include "cf_printf.h"
 
 CFStringRef kRoutesKey = CFSTR("com.coriolis-systems.StaticRoutes");
+CFStringRef kRollbackKey
+  = CFSTR("State:/com.coriolis-systems.StaticRoutes/Rollback");
+CFStringRef kRollbackResultKey
+  = CFSTR("State:/com.coriolis-systems.StaticRoutes/RollbackResult");
+const CFTimeInterval kRollbackMaxWait = 600.0;
 SCPreferencesRef systemConfPrefs;
 SCDynamicStoreRef dynamicStore;
 
@@ -34,6 +40,10 @@ int list_all_routes (void);
 int list_routes (const char *service_name);
 int add_route (struct destination dest, const char *service_name);
 int delete_route (struct destination dest, const char *service_name);
+int rollback (int generations);
+void rollback_result_changed (SCDynamicStoreRef store,
+                              CFArrayRef changedKeys,
+                              void *info);
 
 CFPropertyListRef
 sc_get_value_at_path (SCPreferencesRef scprefs,
@@ -89,6 +99,11 @@ const char *usage_text =
 "\n"
 "       Removes a static route from the specified service in the current\n"
 "       location.\n"
+"\n"
+"usage: staticroute rollback [generations]\n"
+"\n"
+"       Undoes the last change to the static route configuration, or the\n"
+"       last <generations> changes if specified.\n"
 "\n";
 
 static void
@@ -258,6 +273,18 @@ main (int argc, char **argv)
     } else {
       ret = delete_route (dest, argv[3]);
     }
+  } else if ((argc == 2 || argc == 3)
+             && strcasecmp (argv[1], "rollback") == 0) {
+    int generations = 1;
+    
+    if (argc == 3
+        && (sscanf (argv[2], "%d", &generations) != 1 || generations < 1)) {
+      cf_fprintf (stderr, CFSTR("staticroute: bad generation count \"%s\".\n"),
+                  argv[2]);
+      ret = 1;
+    } else {
+      ret = rollback (generations);
+    }
   } else
     usage ();
 
@@ -746,3 +773,149 @@ delete_route (struct destination dest, const char *service_name)
   return ret;
 }
 
+void
+rollback_result_changed (SCDynamicStoreRef store,
+                         CFArrayRef changedKeys,
+                         void *info)
+{
+  CFRunLoopStop (CFRunLoopGetCurrent ());
+}
+
+int
+rollback (int generations)
+{
+  // Tag the request so we can recognise staticrouted's response to it
+  CFAbsoluteTime now = CFAbsoluteTimeGetCurrent ();
+  CFNumberRef requestID = CFNumberCreate (kCFAllocatorDefault,
+                                          kCFNumberDoubleType, &now);
+  CFNumberRef generationsNum = CFNumberCreate (kCFAllocatorDefault,
+                                               kCFNumberIntType, &generations);
+  CFStringRef keys[] = { CFSTR("request"), CFSTR("generations") };
+  CFTypeRef values[2] = { requestID, generationsNum };
+  CFDictionaryRef request = CFDictionaryCreate(kCFAllocatorDefault,
+                                               (const void **)keys,
+                                               (const void **)values, 2,
+                                               &kCFTypeDictionaryKeyCallBacks,
+                                               &kCFTypeDictionaryValueCallBacks);
+  int ret = 1;
+  
+  CFRelease (generationsNum);
+  
+  // Watch for the result before posting the request, so we can't miss it
+  SCDynamicStoreRef resultStore = SCDynamicStoreCreate (kCFAllocatorDefault,
+                                                        CFSTR("staticroute"),
+                                                        rollback_result_changed,
+                                                        NULL);
+  
+  if (!resultStore) {
+    cf_fprintf (stderr,
+                CFSTR("staticroute: unable to watch for the rollback "
+                      "result.\n"));
+    CFRelease (request);
+    CFRelease (requestID);
+    return 1;
+  }
+  
+  CFArrayRef watchedKeys = CFArrayCreate (kCFAllocatorDefault,
+                                          (const void **)&kRollbackResultKey,
+                                          1, &kCFTypeArrayCallBacks);
+  CFRunLoopSourceRef source
+    = SCDynamicStoreCreateRunLoopSource (kCFAllocatorDefault, resultStore, 0);
+  
+  SCDynamicStoreSetNotificationKeys (resultStore, watchedKeys, NULL);
+  CFRelease (watchedKeys);
+  CFRunLoopAddSource (CFRunLoopGetCurrent (), source, kCFRunLoopDefaultMode);
+  
+  if (!SCDynamicStoreSetValue (dynamicStore, kRollbackKey, request)) {
+    cf_fprintf (stderr,
+                CFSTR("staticroute: cannot send rollback request to "
+                      "staticrouted.\n"));
+    CFRunLoopRemoveSource (CFRunLoopGetCurrent (), source,
+                           kCFRunLoopDefaultMode);
+    CFRelease (source);
+    CFRelease (resultStore);
+    CFRelease (request);
+    CFRelease (requestID);
+    return 1;
+  }
+  
+  CFRelease (request);
+  
+  /* Wait for staticrouted to respond.  It marks the result as in progress
+     when it picks the request up, and we keep waiting while that is so; we
+     give up if nothing happens for five seconds, or if the whole thing takes
+     longer than kRollbackMaxWait.  The marker belongs to staticrouted's
+     session, so it goes away if staticrouted dies. */
+  CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent () + kRollbackMaxWait;
+  bool gotResult = false;
+  bool inProgress = false;
+  
+  while (!gotResult) {
+    CFDictionaryRef result = SCDynamicStoreCopyValue (dynamicStore,
+                                                      kRollbackResultKey);
+    
+    inProgress = false;
+    
+    if (result) {
+      CFTypeRef resultID = CFDictionaryGetValue (result, CFSTR("request"));
+      
+      if (resultID && CFEqual (resultID, requestID)) {
+        CFNumberRef status = CFDictionaryGetValue (result, CFSTR("status"));
+        CFStringRef message = CFDictionaryGetValue (result, CFSTR("message"));
+          
+        if (status) {
+          CFNumberGetValue (status, kCFNumberIntType, &ret);
+          
+          if (ret)
+            cf_fprintf (stderr, CFSTR("staticroute: %@.\n"), message);
+          else
+            cf_printf (CFSTR("Configuration %@.\n"), message);
+          
+          gotResult = true;
+        } else
+          inProgress = true;
+      } else if (CFDictionaryContainsKey (result, CFSTR("inProgress"))) {
+        // staticrouted is busy with someone else's rollback; ours is next
+        inProgress = true;
+      }
+      
+      CFRelease (result);
+    }
+    
+    if (gotResult)
+      break;
+    
+    CFTimeInterval remaining = deadline - CFAbsoluteTimeGetCurrent ();
+    
+    if (remaining <= 0)
+      break;
+    
+    if (CFRunLoopRunInMode (kCFRunLoopDefaultMode,
+                            remaining < 5.0 ? remaining : 5.0,
+                            true) == kCFRunLoopRunTimedOut
+        && !inProgress)
+      break;
+  }
+  
+  CFRunLoopRemoveSource (CFRunLoopGetCurrent (), source,
+                         kCFRunLoopDefaultMode);
+  CFRelease (source);
+  CFRelease (resultStore);
+  
+  if (!gotResult) {
+    if (inProgress) {
+      cf_fprintf (stderr,
+                  CFSTR("staticroute: timed out waiting for staticrouted to "
+                        "finish rolling back.\n"));
+    } else {
+      cf_fprintf (stderr,
+                  CFSTR("staticroute: no response from staticrouted; is it "
+                        "running?\n"));
+    }
+    ret = 1;
+  }
+  
+  CFRelease (requestID);
+
+  return ret;
+}
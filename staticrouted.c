@@ -15,33 +15,138 @@
 #include <spawn.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
 
 #include "cf_printf.h"
+#include "vclock.h"
 
 CFStringRef kRoutesKey = CFSTR("com.coriolis-systems.StaticRoutes");
 SCPreferencesRef systemConfPrefs;
 SCDynamicStoreRef dynamicStore;
 
+/* Route operations waiting to be applied to the kernel, keyed by service ID
+   and route key.  Each entry records the router the kernel currently has
+   ("oldRouter") and the router we want ("router"); either may be absent.  A
+   new operation for the same key is merged into the existing entry, so an
+   add followed by a delete vanishes entirely, a delete followed by an add
+   becomes a change (or nothing) and repeated adds collapse into one. */
+CFMutableDictionaryRef pendingRouteOps;
+vclock_timer_t routeOpsTimer;
+const CFTimeInterval kRouteOpsDelay = 0.5;
+
+/* When replaying events (-S), the dynamic store is simulated so that we
+   neither read the real network state nor publish ours, the configuration
+   may come from a file, and route/pfctl commands are counted, not run. */
+CFMutableDictionaryRef simulatedStore;
+CFDictionaryRef simulatedConfig;
+long simulatedRouteCommands;
+long simulatedPfctlCommands;
+
+/* Services with at least this many routes for an address family have those
+   routes loaded into a pf table instead of the kernel routing table, with a
+   single route-to rule sending matching traffic to the service's router and
+   a nat rule giving it the service interface's source address.  The anchor
+   lives under com.apple so that the stock pf.conf evaluates both.
+   We don't enable pf ourselves; that is left to the administrator. */
+const CFIndex kPFTableThreshold = 1024;
+CFStringRef kPFAnchorPrefix = CFSTR("com.apple/250.StaticRoutes.");
+
+/* A table stays loaded while its service is down, so that coming back up
+   only needs the rules reloading.  The digest of each table's prefix set is
+   cached per service until its routes change, so that we needn't rebuild
+   the prefix list on every state change just to see that it is the same. */
+CFMutableDictionaryRef pfTableDigests;
+
+/* Configuration generations.  We keep the most recent route configuration
+   we have seen, together with the diffs that led to it from each of the
+   previous kMaxGenerations configurations (newest first), so that
+   "staticroute rollback" can undo a bad change in a single batch. */
+CFStringRef kRollbackKey
+  = CFSTR("State:/com.coriolis-systems.StaticRoutes/Rollback");
+CFStringRef kRollbackResultKey
+  = CFSTR("State:/com.coriolis-systems.StaticRoutes/RollbackResult");
+const CFIndex kMaxGenerations = 10;
+CFMutableDictionaryRef currentConfig;
+CFMutableArrayRef generationDiffs;
+
+/* Only services that are up keep their routes in currentConfig as a CFArray;
+   everyone else's are held as a serialised binary property list, which is
+   far more compact, and only turned back into objects when the service
+   comes up.  The per-service diffs in generationDiffs are held the same
+   way, since they are only needed again on rollback.  configSignature lets
+   us skip rebuilding currentConfig when a Setup: change didn't touch the
+   preferences. */
+CFDataRef configSignature;
+
 void dynamic_store_changed (SCDynamicStoreRef store,
                             CFArrayRef changedKeys,
                             void *info);
 void setup_routes_for_service (CFStringRef serviceID);
+void queue_route_op (CFStringRef serviceID,
+                     CFStringRef key,
+                     CFStringRef addressFamily,
+                     CFStringRef address,
+                     CFNumberRef prefixLen,
+                     CFStringRef oldRouter,
+                     CFStringRef router);
+void flush_route_ops (void *info);
+void flush_route_ops_now (void);
+void record_generation (void);
+void forget_pf_digests (const void *value, void *context);
+void forget_diff_pf_digests (const void *key,
+                             const void *value,
+                             void *context);
+void handle_rollback_request (void);
+void setup_pf_tables (CFStringRef serviceID,
+                      CFArrayRef routes,
+                      CFStringRef ipv4Router,
+                      CFStringRef ipv4Interface,
+                      bool ipv4Table,
+                      CFStringRef ipv6Router,
+                      CFStringRef ipv6Interface,
+                      bool ipv6Table);
 bool remove_route (CFStringRef address,
                    CFNumberRef prefixLen,
                    CFStringRef router);
 bool add_route (CFStringRef address,
                 CFNumberRef prefixLen,
                 CFStringRef router);
+bool change_route (CFStringRef address,
+                   CFNumberRef prefixLen,
+                   CFStringRef router);
 bool do_route (const char *cmd,
                CFStringRef address,
                CFNumberRef prefixLen,
                CFStringRef router);
+bool do_pfctl (CFDataRef input, CFStringRef anchor, ...);
+bool run_command (const char *path, char * const argv[], CFDataRef input);
+int run_simulation (const char *eventsPath, const char *routesPath);
 
 int
-main (void)
+main (int argc, char **argv)
 {
   CFErrorRef err;
   SCDynamicStoreContext context;
+  const char *eventsPath = NULL;
+  int ch;
+  
+  while ((ch = getopt (argc, argv, "S:")) != -1) {
+    switch (ch) {
+      case 'S':
+        // Replay events against a simulated clock and exit
+        eventsPath = optarg;
+        break;
+      default:
+        fputs ("usage: staticrouted [-S events [routes]]\n", stderr);
+        return 1;
+    }
+  }
+  
+  if (optind < argc - (eventsPath ? 1 : 0)) {
+    fputs ("usage: staticrouted [-S events [routes]]\n", stderr);
+    return 1;
+  }
   
   systemConfPrefs = SCPreferencesCreate (kCFAllocatorDefault,
                                          CFSTR("staticroute"),
@@ -61,6 +166,13 @@ main (void)
     return 1;
   }
   
+  if (eventsPath) {
+    int ret = run_simulation (eventsPath,
+                              optind < argc ? argv[optind] : NULL);
+    CFRelease (systemConfPrefs);
+    return ret;
+  }
+  
   memset (&context, 0, sizeof (context));
   
   dynamicStore = SCDynamicStoreCreate (kCFAllocatorDefault,
@@ -83,6 +195,20 @@ main (void)
     return 1;
   }    
 
+  pendingRouteOps = CFDictionaryCreateMutable (kCFAllocatorDefault,
+                                               0,
+                                               &kCFTypeDictionaryKeyCallBacks,
+                                               &kCFTypeDictionaryValueCallBacks);
+  generationDiffs = CFArrayCreateMutable (kCFAllocatorDefault, 0,
+                                          &kCFTypeArrayCallBacks);
+  pfTableDigests = CFDictionaryCreateMutable (kCFAllocatorDefault,
+                                              0,
+                                              &kCFTypeDictionaryKeyCallBacks,
+                                              &kCFTypeDictionaryValueCallBacks);
+  
+  // We feed data to pfctl through a pipe; don't die if it goes away
+  signal (SIGPIPE, SIG_IGN);
+  
   // Bind the store to the run loop
   CFRunLoopRef runLoop = CFRunLoopGetCurrent();
   CFRunLoopSourceRef storeSource
@@ -99,7 +225,11 @@ main (void)
   CFArrayRef regexps = CFArrayCreate (kCFAllocatorDefault,
                                       (const void **)regexpArray, 2,
                                       &kCFTypeArrayCallBacks);
-  SCDynamicStoreSetNotificationKeys (dynamicStore, NULL, regexps);
+  CFArrayRef watchedKeys = CFArrayCreate (kCFAllocatorDefault,
+                                          (const void **)&kRollbackKey, 1,
+                                          &kCFTypeArrayCallBacks);
+  SCDynamicStoreSetNotificationKeys (dynamicStore, watchedKeys, regexps);
+  CFRelease (watchedKeys);
   CFRelease (regexps);
   
   // Trigger immediately
@@ -110,6 +240,13 @@ main (void)
   // Run
   CFRunLoopRun ();
   
+  if (currentConfig)
+    CFRelease (currentConfig);
+  if (configSignature)
+    CFRelease (configSignature);
+  CFRelease (generationDiffs);
+  CFRelease (pfTableDigests);
+  CFRelease (pendingRouteOps);
   CFRelease (dynamicStore);
   CFRelease (systemConfPrefs);
   CFRelease (storeSource);
@@ -136,8 +273,29 @@ dynamic_store_changed (SCDynamicStoreRef store,
                                                 0,
                                                 &kCFTypeSetCallBacks);
   
+  /* Notice any change to the configuration before we act on it.  staticroute
+     touches the service's Setup: key whenever it writes the preferences, so
+     there's no need to look at them for State: changes, which are far more
+     frequent. */
+  bool configChanged = !currentConfig;
+  
+  for (n = 0; !configChanged && n < numKeys; ++n) {
+    if (CFStringHasPrefix (CFArrayGetValueAtIndex (changedKeys, n),
+                           CFSTR("Setup:")))
+      configChanged = true;
+  }
+  
+  if (configChanged)
+    record_generation ();
+  
   for (n = 0; n < numKeys; ++n) {
     CFStringRef key = CFArrayGetValueAtIndex (changedKeys, n);
+    
+    if (CFStringCompare (key, kRollbackKey, 0) == kCFCompareEqualTo) {
+      handle_rollback_request ();
+      continue;
+    }
+    
     CFArrayRef components = 
       CFStringCreateArrayBySeparatingStrings (kCFAllocatorDefault,
                                               key,
@@ -156,6 +314,85 @@ dynamic_store_changed (SCDynamicStoreRef store,
   CFRelease (services);
 }
 
+CFPropertyListRef
+store_copy_value (CFStringRef key)
+{
+  if (simulatedStore) {
+    CFPropertyListRef value = CFDictionaryGetValue (simulatedStore, key);
+    
+    return value ? CFRetain (value) : NULL;
+  }
+  
+  return SCDynamicStoreCopyValue (dynamicStore, key);
+}
+
+void
+store_set_value (CFStringRef key, CFPropertyListRef value)
+{
+  if (simulatedStore)
+    CFDictionarySetValue (simulatedStore, key, value);
+  else
+    SCDynamicStoreSetValue (dynamicStore, key, value);
+}
+
+void
+store_remove_value (CFStringRef key)
+{
+  if (simulatedStore)
+    CFDictionaryRemoveValue (simulatedStore, key);
+  else
+    SCDynamicStoreRemoveValue (dynamicStore, key);
+}
+
+void
+store_set_simulated (const void *key, const void *value, void *context)
+{
+  CFDictionarySetValue (simulatedStore, key, value);
+}
+
+void
+store_set_multiple (CFDictionaryRef values)
+{
+  if (simulatedStore)
+    CFDictionaryApplyFunction (values, store_set_simulated, NULL);
+  else
+    SCDynamicStoreSetMultiple (dynamicStore, values, NULL, NULL);
+}
+
+CFStringRef
+create_route_key (CFDictionaryRef route)
+{
+  return CFStringCreateWithFormat (kCFAllocatorDefault,
+                                   NULL,
+                                   CFSTR("%@/%@/%@"),
+                                   CFDictionaryGetValue (route,
+                                                         CFSTR("addressFamily")),
+                                   CFDictionaryGetValue (route,
+                                                         CFSTR("address")),
+                                   CFDictionaryGetValue (route,
+                                                         CFSTR("prefixLength")));
+}
+
+CFDictionaryRef
+create_route_info (CFStringRef addressFamily,
+                   CFStringRef address,
+                   CFNumberRef prefixLen,
+                   CFStringRef router)
+{
+  CFTypeRef keys[4] = { 
+    CFSTR("addressFamily"),
+    CFSTR("address"),
+    CFSTR("prefixLength"),
+    CFSTR("router")
+  };
+  CFTypeRef values[4] = { addressFamily, address, prefixLen, router };
+  
+  return CFDictionaryCreate(kCFAllocatorDefault,
+                            keys, values, 4,
+                            &kCFTypeDictionaryKeyCallBacks,
+                            &kCFTypeDictionaryValueCallBacks);
+}
+
 struct remove_ctx {
   CFStringRef serviceID;
   CFMutableDictionaryRef activeStaticRoutes;
@@ -166,43 +403,127 @@ remove_routes (const void *key, const void *value, void *context)
 {
   struct remove_ctx *ctx = (struct remove_ctx *)context;
   CFDictionaryRef route = (CFDictionaryRef)value;
+  CFStringRef addressFamily = CFDictionaryGetValue (route,
+                                                    CFSTR("addressFamily"));
   CFStringRef address = CFDictionaryGetValue (route, CFSTR("address"));
   CFNumberRef prefixLen = CFDictionaryGetValue (route,
                                                 CFSTR("prefixLength"));
   CFStringRef router = CFDictionaryGetValue (route, CFSTR("router"));
   
   if (address && prefixLen && router) {
-    cf_fprintf (stderr,
-                CFSTR("staticrouted: removing route %@/%@ -> %@ for service %@.\n"),
-                address, prefixLen, router,
-                ctx->serviceID);
-    
-    if (remove_route (address, prefixLen, router))
-      CFDictionaryRemoveValue (ctx->activeStaticRoutes, key);
+    queue_route_op (ctx->serviceID, (CFStringRef)key,
+                    addressFamily, address, prefixLen,
+                    router, NULL);
+  }
+  
+  CFDictionaryRemoveValue (ctx->activeStaticRoutes, key);
+}
+
+void
+collect_malformed_route (const void *key, const void *value, void *context)
+{
+  CFMutableArrayRef malformed = (CFMutableArrayRef)context;
+  CFDictionaryRef route = (CFDictionaryRef)value;
+  
+  if (CFGetTypeID (route) != CFDictionaryGetTypeID ()
+      || !CFDictionaryGetValue (route, CFSTR("address"))
+      || !CFDictionaryGetValue (route, CFSTR("prefixLength"))
+      || !CFDictionaryGetValue (route, CFSTR("router")))
+    CFArrayAppendValue (malformed, key);
+}
+
+void
+overlay_pending_op (const void *key, const void *value, void *context)
+{
+  struct remove_ctx *ctx = (struct remove_ctx *)context;
+  CFDictionaryRef op = (CFDictionaryRef)value;
+  CFStringRef routeKey = (CFStringRef)key;
+  CFStringRef router = CFDictionaryGetValue (op, CFSTR("router"));
+  
+  if (router) {
+    CFDictionaryRef routeInfo
+      = create_route_info (CFDictionaryGetValue (op, CFSTR("addressFamily")),
+                           CFDictionaryGetValue (op, CFSTR("address")),
+                           CFDictionaryGetValue (op, CFSTR("prefixLength")),
+                           router);
+    CFDictionarySetValue (ctx->activeStaticRoutes, routeKey, routeInfo);
+    CFRelease (routeInfo);
   } else {
-    CFDictionaryRemoveValue (ctx->activeStaticRoutes, key);
+    CFDictionaryRemoveValue (ctx->activeStaticRoutes, routeKey);
+  }
+}
+
+CFDataRef
+create_blob (CFPropertyListRef plist)
+{
+  return CFPropertyListCreateData (kCFAllocatorDefault,
+                                   plist,
+                                   kCFPropertyListBinaryFormat_v1_0,
+                                   0,
+                                   NULL);
+}
+
+CFArrayRef
+copy_config_routes (CFDictionaryRef config, CFStringRef serviceID)
+{
+  CFTypeRef entry = config ? CFDictionaryGetValue (config, serviceID) : NULL;
+  
+  if (!entry)
+    return NULL;
+  
+  if (CFGetTypeID (entry) == CFArrayGetTypeID ())
+    return CFRetain (entry);
+  
+  if (CFGetTypeID (entry) != CFDataGetTypeID ())
+    return NULL;
+  
+  CFPropertyListRef routes
+    = CFPropertyListCreateWithData (kCFAllocatorDefault,
+                                    (CFDataRef)entry,
+                                    kCFPropertyListImmutable,
+                                    NULL,
+                                    NULL);
+  
+  if (routes && CFGetTypeID (routes) != CFArrayGetTypeID ()) {
+    CFRelease (routes);
+    return NULL;
   }
+  
+  return routes;
 }
 
 void
-setup_routes_for_service (CFStringRef serviceID)
+set_service_residency (CFStringRef serviceID,
+                       CFArrayRef routes,
+                       bool resident)
 {
-  SCPreferencesSynchronize (systemConfPrefs);
-  SCPreferencesLock (systemConfPrefs, true);
-  CFDictionaryRef staticRoutes = SCPreferencesGetValue (systemConfPrefs,
-                                                        kRoutesKey);
-  CFArrayRef routes;
-  CFIndex routeCount;
+  CFTypeRef entry = CFDictionaryGetValue (currentConfig, serviceID);
+  bool isResident = entry && CFGetTypeID (entry) == CFArrayGetTypeID ();
   
-  if (!staticRoutes) {
-    SCPreferencesUnlock (systemConfPrefs);
+  if (!entry || resident == isResident)
     return;
-  }
   
-  routes = CFDictionaryGetValue (staticRoutes, serviceID);
+  if (resident) {
+    CFDictionarySetValue (currentConfig, serviceID, routes);
+  } else {
+    CFDataRef blob = create_blob (routes);
+    
+    if (blob) {
+      CFDictionarySetValue (currentConfig, serviceID, blob);
+      CFRelease (blob);
+    }
+  }
+}
+
+void
+setup_routes_for_service (CFStringRef serviceID)
+{
+  CFArrayRef routes = copy_config_routes (currentConfig, serviceID);
+  CFIndex routeCount;
   
+  // A service with no routes at all may still have pf tables to remove
   if (!routes) {
-    SCPreferencesUnlock (systemConfPrefs);
+    setup_pf_tables (serviceID, NULL, NULL, NULL, false, NULL, NULL, false);
     return;
   }
   
@@ -215,8 +536,7 @@ setup_routes_for_service (CFStringRef serviceID)
                                 serviceID);
   CFMutableDictionaryRef activeStaticRoutes = NULL;
   {
-    CFDictionaryRef activeStaticRoutesOrig = SCDynamicStoreCopyValue(dynamicStore,
-                                                                     dynamicKey);
+    CFDictionaryRef activeStaticRoutesOrig = store_copy_value (dynamicKey);
     
     if (activeStaticRoutesOrig) {
       activeStaticRoutes = CFDictionaryCreateMutableCopy(kCFAllocatorDefault,
@@ -230,6 +550,34 @@ setup_routes_for_service (CFStringRef serviceID)
                                                      &kCFTypeDictionaryValueCallBacks);
     }
   }
+  
+  /* Entries we can't do anything with will never go through the queue, so
+     purge them from the dynamic store here */
+  CFMutableArrayRef malformed = CFArrayCreateMutable (kCFAllocatorDefault, 0,
+                                                      &kCFTypeArrayCallBacks);
+  
+  CFDictionaryApplyFunction (activeStaticRoutes, collect_malformed_route,
+                             malformed);
+  
+  if (CFArrayGetCount (malformed)) {
+    for (CFIndex n = 0; n < CFArrayGetCount (malformed); ++n)
+      CFDictionaryRemoveValue (activeStaticRoutes,
+                               CFArrayGetValueAtIndex (malformed, n));
+    
+    store_set_value (dynamicKey, activeStaticRoutes);
+  }
+  
+  CFRelease (malformed);
+  
+  /* The dynamic store reflects what is in the kernel; overlay anything still
+     queued so that we compare against the state we have already asked for */
+  struct remove_ctx ctx = { serviceID, activeStaticRoutes };
+  CFDictionaryRef serviceOps = CFDictionaryGetValue (pendingRouteOps,
+                                                     serviceID);
+  
+  if (serviceOps)
+    CFDictionaryApplyFunction (serviceOps, overlay_pending_op, &ctx);
+  
   CFMutableDictionaryRef inactiveStaticRoutes
     = CFDictionaryCreateMutableCopy (kCFAllocatorDefault,
                                      0,
@@ -245,10 +593,8 @@ setup_routes_for_service (CFStringRef serviceID)
                                 NULL,
                                 CFSTR("State:/Network/Service/%@/IPv6"),
                                 serviceID);
-  CFDictionaryRef serviceStateIPv4 = SCDynamicStoreCopyValue (dynamicStore,
-                                                              ipv4Key);
-  CFDictionaryRef serviceStateIPv6 = SCDynamicStoreCopyValue (dynamicStore,
-                                                              ipv6Key);
+  CFDictionaryRef serviceStateIPv4 = store_copy_value (ipv4Key);
+  CFDictionaryRef serviceStateIPv6 = store_copy_value (ipv6Key);
   CFRelease (ipv4Key);
   CFRelease (ipv6Key);
     
@@ -316,6 +662,26 @@ setup_routes_for_service (CFStringRef serviceID)
     }
   }
   
+  // Huge prefix sets go into pf tables rather than the routing table
+  CFIndex ipv4Count = 0;
+  CFIndex ipv6Count = 0;
+  
+  for (CFIndex n = 0; n < routeCount; ++n) {
+    CFDictionaryRef route = CFArrayGetValueAtIndex (routes, n);
+    CFStringRef addressFamily = CFDictionaryGetValue (route,
+                                                      CFSTR("addressFamily"));
+    
+    if (CFStringCompare (addressFamily, CFSTR("IPv4"), 0)
+        == kCFCompareEqualTo)
+      ++ipv4Count;
+    else if (CFStringCompare (addressFamily, CFSTR("IPv6"), 0)
+             == kCFCompareEqualTo)
+      ++ipv6Count;
+  }
+  
+  bool ipv4Table = ipv4Count >= kPFTableThreshold;
+  bool ipv6Table = ipv6Count >= kPFTableThreshold;
+  
   for (CFIndex n = 0; n < routeCount; ++n) {
     CFDictionaryRef route = CFArrayGetValueAtIndex (routes, n);
     CFStringRef addressFamily = CFDictionaryGetValue (route,
@@ -327,68 +693,47 @@ setup_routes_for_service (CFStringRef serviceID)
     
     if (CFStringCompare (addressFamily, CFSTR("IPv4"), 0)
         == kCFCompareEqualTo)
-      router = ipv4Router;
+      router = ipv4Table ? NULL : ipv4Router;
     else if (CFStringCompare (addressFamily, CFSTR("IPv6"), 0)
              == kCFCompareEqualTo)
-      router = ipv6Router;
+      router = ipv6Table ? NULL : ipv6Router;
     
     if (!router)
       continue;
     
-    CFStringRef key = CFStringCreateWithFormat (kCFAllocatorDefault,
-                                                NULL,
-                                                CFSTR("%@/%@/%@"),
-                                                addressFamily,
-                                                address,
-                                                prefixLen);
+    CFStringRef key = create_route_key (route);
     CFDictionaryRef oldRouteInfo = CFDictionaryGetValue (activeStaticRoutes, key);
     CFStringRef oldRouter = (oldRouteInfo
                              ? CFDictionaryGetValue (oldRouteInfo, CFSTR("router"))
                              : NULL);
-    if (oldRouter && CFStringCompare (router, oldRouter, 0) == kCFCompareEqualTo) {
-      CFDictionaryRemoveValue (inactiveStaticRoutes, key);
-      CFRelease (key);
-      continue;
-    }
-    
-    if (oldRouter) {
-      cf_fprintf (stderr,
-                  CFSTR("staticrouted: removing old route %@/%@ -> %@ for "
-                        "service %@.\n"),
-                  address, prefixLen, oldRouter,
-                  serviceID);
-      if (remove_route (address, prefixLen, oldRouter))
-        CFDictionaryRemoveValue (activeStaticRoutes, key);
-      CFDictionaryRemoveValue (inactiveStaticRoutes, key);
-    }
+    CFDictionaryRemoveValue (inactiveStaticRoutes, key);
     
-    cf_fprintf (stderr,
-                CFSTR("staticrouted: adding route %@/%@ -> %@ for service %@.\n"),
-                address, prefixLen, router,
-                serviceID);    
-    if (add_route (address, prefixLen, router)) {
-      CFTypeRef keys[4] = { 
-        CFSTR("addressFamily"),
-        CFSTR("address"),
-        CFSTR("prefixLength"),
-        CFSTR("router")
-      };
-      CFTypeRef values[4] = { addressFamily, address, prefixLen, router };
-      CFDictionaryRef routeInfo = CFDictionaryCreate(kCFAllocatorDefault,
-                                                     keys, values, 4,
-                                                     &kCFTypeDictionaryKeyCallBacks,
-                                                     &kCFTypeDictionaryValueCallBacks);
-      CFDictionaryAddValue (activeStaticRoutes, key, routeInfo);
-      CFDictionaryRemoveValue (inactiveStaticRoutes, key);
-      CFRelease (routeInfo);
-    }
+    if (!oldRouter || CFStringCompare (router, oldRouter, 0) != kCFCompareEqualTo)
+      queue_route_op (serviceID, key, addressFamily, address, prefixLen,
+                      oldRouter, router);
     
     CFRelease (key);
   }
   
-  struct remove_ctx ctx = { serviceID, activeStaticRoutes };
   CFDictionaryApplyFunction(inactiveStaticRoutes, remove_routes, &ctx);
   
+  setup_pf_tables (serviceID, routes,
+                   ipv4Router,
+                   (serviceStateIPv4
+                    ? CFDictionaryGetValue (serviceStateIPv4,
+                                            CFSTR("InterfaceName"))
+                    : NULL),
+                   ipv4Table,
+                   ipv6Router,
+                   (serviceStateIPv6
+                    ? CFDictionaryGetValue (serviceStateIPv6,
+                                            CFSTR("InterfaceName"))
+                    : NULL),
+                   ipv6Table);
+  
+  // Keep the routes in memory only while the service is up
+  set_service_residency (serviceID, routes, ipv4Router || ipv6Router);
+  
   if (serviceStateIPv4)
     CFRelease (serviceStateIPv4);
   if (serviceStateIPv6)
@@ -398,103 +743,1287 @@ setup_routes_for_service (CFStringRef serviceID)
   if (ipv6Router)
     CFRelease (ipv6Router);
   
-  SCDynamicStoreSetValue(dynamicStore, dynamicKey, activeStaticRoutes);
-  
   CFRelease (dynamicKey);
   CFRelease (activeStaticRoutes);
   CFRelease (inactiveStaticRoutes);
-  SCPreferencesUnlock (systemConfPrefs);
+  CFRelease (routes);
 }
 
-bool
-remove_route (CFStringRef address,
-              CFNumberRef prefixLen,
-              CFStringRef router)
+void
+queue_route_op (CFStringRef serviceID,
+                CFStringRef key,
+                CFStringRef addressFamily,
+                CFStringRef address,
+                CFNumberRef prefixLen,
+                CFStringRef oldRouter,
+                CFStringRef router)
 {
-  return do_route ("delete", address, prefixLen, router);
+  CFMutableDictionaryRef serviceOps
+    = (CFMutableDictionaryRef)CFDictionaryGetValue (pendingRouteOps,
+                                                    serviceID);
+  CFDictionaryRef queuedOp = (serviceOps
+                              ? CFDictionaryGetValue (serviceOps, key)
+                              : NULL);
+  
+  // If there is already an operation queued, the kernel has its old router
+  if (queuedOp)
+    oldRouter = CFDictionaryGetValue (queuedOp, CFSTR("oldRouter"));
+  
+  if ((!oldRouter && !router)
+      || (oldRouter && router
+          && CFStringCompare (router, oldRouter, 0) == kCFCompareEqualTo)) {
+    // The operations cancel out, so the kernel need never see them
+    if (serviceOps) {
+      CFDictionaryRemoveValue (serviceOps, key);
+      if (!CFDictionaryGetCount (serviceOps))
+        CFDictionaryRemoveValue (pendingRouteOps, serviceID);
+    }
+  } else {
+    CFMutableDictionaryRef op
+      = CFDictionaryCreateMutable (kCFAllocatorDefault,
+                                   0,
+                                   &kCFTypeDictionaryKeyCallBacks,
+                                   &kCFTypeDictionaryValueCallBacks);
+    
+    CFDictionarySetValue (op, CFSTR("addressFamily"), addressFamily);
+    CFDictionarySetValue (op, CFSTR("address"), address);
+    CFDictionarySetValue (op, CFSTR("prefixLength"), prefixLen);
+    if (oldRouter)
+      CFDictionarySetValue (op, CFSTR("oldRouter"), oldRouter);
+    if (router)
+      CFDictionarySetValue (op, CFSTR("router"), router);
+    
+    if (!serviceOps) {
+      serviceOps
+        = CFDictionaryCreateMutable (kCFAllocatorDefault,
+                                     0,
+                                     &kCFTypeDictionaryKeyCallBacks,
+                                     &kCFTypeDictionaryValueCallBacks);
+      CFDictionarySetValue (pendingRouteOps, serviceID, serviceOps);
+      CFRelease (serviceOps);
+    }
+    
+    CFDictionarySetValue (serviceOps, key, op);
+    CFRelease (op);
+  }
+  
+  // Make sure the queue gets flushed
+  if (CFDictionaryGetCount (pendingRouteOps) && !routeOpsTimer)
+    routeOpsTimer = vclock_schedule (kRouteOpsDelay, flush_route_ops, NULL);
 }
 
-bool
-add_route (CFStringRef address,
-           CFNumberRef prefixLen,
-           CFStringRef router)
+void
+apply_route_op (const void *key, const void *value, void *context)
 {
-  return do_route ("add", address, prefixLen, router);
+  struct remove_ctx *ctx = (struct remove_ctx *)context;
+  CFStringRef serviceID = ctx->serviceID;
+  CFMutableDictionaryRef activeStaticRoutes = ctx->activeStaticRoutes;
+  CFDictionaryRef op = (CFDictionaryRef)value;
+  CFStringRef routeKey = (CFStringRef)key;
+  CFStringRef addressFamily = CFDictionaryGetValue (op,
+                                                    CFSTR("addressFamily"));
+  CFStringRef address = CFDictionaryGetValue (op, CFSTR("address"));
+  CFNumberRef prefixLen = CFDictionaryGetValue (op, CFSTR("prefixLength"));
+  CFStringRef oldRouter = CFDictionaryGetValue (op, CFSTR("oldRouter"));
+  CFStringRef router = CFDictionaryGetValue (op, CFSTR("router"));
+  
+  if (oldRouter && router) {
+    cf_fprintf (stderr,
+                CFSTR("staticrouted: changing route %@/%@ -> %@ (was %@) for "
+                      "service %@.\n"),
+                address, prefixLen, router, oldRouter,
+                serviceID);
+    if (change_route (address, prefixLen, router)) {
+      CFDictionaryRef routeInfo = create_route_info (addressFamily, address,
+                                                     prefixLen, router);
+      CFDictionarySetValue (activeStaticRoutes, routeKey, routeInfo);
+      CFRelease (routeInfo);
+    }
+  } else if (oldRouter) {
+    cf_fprintf (stderr,
+                CFSTR("staticrouted: removing route %@/%@ -> %@ for service %@.\n"),
+                address, prefixLen, oldRouter,
+                serviceID);
+    if (remove_route (address, prefixLen, oldRouter))
+      CFDictionaryRemoveValue (activeStaticRoutes, routeKey);
+  } else {
+    cf_fprintf (stderr,
+                CFSTR("staticrouted: adding route %@/%@ -> %@ for service %@.\n"),
+                address, prefixLen, router,
+                serviceID);
+    if (add_route (address, prefixLen, router)) {
+      CFDictionaryRef routeInfo = create_route_info (addressFamily, address,
+                                                     prefixLen, router);
+      CFDictionarySetValue (activeStaticRoutes, routeKey, routeInfo);
+      CFRelease (routeInfo);
+    }
+  }
 }
 
-bool
-do_route (const char *cmd,
-          CFStringRef address,
-          CFNumberRef prefixLen,
-          CFStringRef router)
+void
+apply_service_route_ops (const void *key, const void *value, void *context)
 {
-  UInt8 routerBuf[256];
-  UInt8 destBuf[256];
-  CFIndex usedBuf = 0;
-  int prefix = 0;
-  
-  // Grab the prefix length as an int
-  CFNumberGetValue (prefixLen, kCFNumberIntType, &prefix);
+  CFMutableDictionaryRef serviceStates = (CFMutableDictionaryRef)context;
+  CFStringRef serviceID = (CFStringRef)key;
+  CFDictionaryRef serviceOps = (CFDictionaryRef)value;
   
-  // Grab the router address as a UTF-8 string
-  usedBuf = 0;
-  CFStringGetBytes (router, CFRangeMake (0, CFStringGetLength (router)),
-                    kCFStringEncodingUTF8, '?', false, routerBuf,
-                    sizeof (routerBuf), &usedBuf);
-  routerBuf[usedBuf] = '\0';
+  // Find the active route state for this service
+  CFStringRef dynamicKey
+    = CFStringCreateWithFormat (kCFAllocatorDefault,
+                                NULL,
+                                CFSTR("State:/com.coriolis-systems.StaticRoutes/Service/%@"),
+                                serviceID);
+  CFMutableDictionaryRef activeStaticRoutes;
+  CFDictionaryRef activeStaticRoutesOrig = store_copy_value (dynamicKey);
   
-  // Grab the address as a UTF-8 string and tack /prefix-len to the end
-  usedBuf = 0;
-  CFStringGetBytes (address, CFRangeMake (0, CFStringGetLength (address)),
-                    kCFStringEncodingUTF8, '?', false, destBuf,
-                    sizeof (destBuf), &usedBuf);
-  sprintf ((char *)destBuf + usedBuf, "/%d", prefix);
+  if (activeStaticRoutesOrig) {
+    activeStaticRoutes = CFDictionaryCreateMutableCopy(kCFAllocatorDefault,
+                                                       0,
+                                                       activeStaticRoutesOrig);
+    CFRelease (activeStaticRoutesOrig);
+  } else {
+    activeStaticRoutes = CFDictionaryCreateMutable(kCFAllocatorDefault,
+                                                   0,
+                                                   &kCFTypeDictionaryKeyCallBacks,
+                                                   &kCFTypeDictionaryValueCallBacks);
+  }
   
-  // Build our route command
-  char * const argv[] = {
-    "/sbin/route",
-    (char *)cmd,
-    (char *)destBuf,
-    (char *)routerBuf
-  };
+  struct remove_ctx ctx = { serviceID, activeStaticRoutes };
+  CFDictionaryApplyFunction (serviceOps, apply_route_op, &ctx);
   
-  // Spawn it
-  pid_t childPid;
-  posix_spawn_file_actions_t actions;
+  CFDictionarySetValue (serviceStates, dynamicKey, activeStaticRoutes);
+  CFRelease (activeStaticRoutes);
+  CFRelease (dynamicKey);
+}
+
+void
+flush_route_ops (void *info)
+{
+  CFMutableDictionaryRef ops = pendingRouteOps;
+  CFMutableDictionaryRef serviceStates
+    = CFDictionaryCreateMutable (kCFAllocatorDefault,
+                                 0,
+                                 &kCFTypeDictionaryKeyCallBacks,
+                                 &kCFTypeDictionaryValueCallBacks);
   
-  posix_spawn_file_actions_init (&actions);
-  posix_spawn_file_actions_addopen (&actions, STDOUT_FILENO,
-                                    "/dev/null", O_RDWR, 0644);
+  // The timer has fired, so it no longer needs cancelling
+  routeOpsTimer = NULL;
   
-  if (posix_spawn (&childPid, "/sbin/route",
-                   &actions, NULL,
-                   argv, NULL) < 0) {
-    posix_spawn_file_actions_destroy (&actions);
-    cf_fprintf (stderr,
-                CFSTR("staticrouted: unable to spawn /sbin/route "
-                      "- errno %d: %s.\n"),
-                errno,
-                strerror (errno));
-    return false;
-  }
+  pendingRouteOps = CFDictionaryCreateMutable (kCFAllocatorDefault,
+                                               0,
+                                               &kCFTypeDictionaryKeyCallBacks,
+                                               &kCFTypeDictionaryValueCallBacks);
   
-  posix_spawn_file_actions_destroy (&actions);
-
-  int status = 0;
+  CFDictionaryApplyFunction (ops, apply_service_route_ops, serviceStates);
   
-  waitpid (childPid, &status, 0);
+  // Publish the new state for every service we touched in one go
+  if (CFDictionaryGetCount (serviceStates))
+    store_set_multiple (serviceStates);
   
-  if (WIFSIGNALED (status)) {
-    cf_fprintf (stderr,
-                CFSTR ("staticrouted: /sbin/route appears to have been "
-                       "killed - signal %d.\n"),
+  CFRelease (serviceStates);
+  CFRelease (ops);
+}
+
+void
+flush_route_ops_now (void)
+{
+  if (routeOpsTimer) {
+    vclock_cancel (routeOpsTimer);
+    flush_route_ops (NULL);
+  }
+}
+
+CFMutableDictionaryRef
+create_routes_by_key (CFArrayRef routes)
+{
+  CFMutableDictionaryRef routesByKey
+    = CFDictionaryCreateMutable (kCFAllocatorDefault,
+                                 0,
+                                 &kCFTypeDictionaryKeyCallBacks,
+                                 &kCFTypeDictionaryValueCallBacks);
+  CFIndex routeCount = routes ? CFArrayGetCount (routes) : 0;
+  
+  for (CFIndex n = 0; n < routeCount; ++n) {
+    CFDictionaryRef route = CFArrayGetValueAtIndex (routes, n);
+    CFStringRef key = create_route_key (route);
+    
+    CFDictionarySetValue (routesByKey, key, route);
+    CFRelease (key);
+  }
+  
+  return routesByKey;
+}
+
+struct missing_ctx {
+  CFDictionaryRef other;
+  CFMutableArrayRef missing;
+};
+
+void
+collect_missing_routes (const void *key, const void *value, void *context)
+{
+  struct missing_ctx *ctx = (struct missing_ctx *)context;
+  
+  if (!CFDictionaryContainsKey (ctx->other, key))
+    CFArrayAppendValue (ctx->missing, value);
+}
+
+void
+collect_service (const void *key, const void *value, void *context)
+{
+  CFSetAddValue ((CFMutableSetRef)context, key);
+}
+
+struct diff_ctx {
+  CFDictionaryRef oldConfig;
+  CFDictionaryRef newConfig;
+  CFMutableDictionaryRef diff;
+};
+
+void
+diff_service (const void *value, void *context)
+{
+  struct diff_ctx *ctx = (struct diff_ctx *)context;
+  CFStringRef serviceID = (CFStringRef)value;
+  CFTypeRef oldEntry = CFDictionaryGetValue (ctx->oldConfig, serviceID);
+  CFArrayRef newRoutes = CFDictionaryGetValue (ctx->newConfig, serviceID);
+  
+  /* Most services won't have changed; compare a service that isn't resident
+     by its serialised form, so that we don't bring every service's routes
+     back into memory whenever the preferences are written.  If the bytes
+     differ for some other reason, the diff below will come out empty. */
+  if (oldEntry && newRoutes) {
+    bool same;
+    
+    if (CFGetTypeID (oldEntry) == CFDataGetTypeID ()) {
+      CFDataRef newBlob = create_blob (newRoutes);
+      
+      same = newBlob && CFEqual (newBlob, oldEntry);
+      if (newBlob)
+        CFRelease (newBlob);
+    } else {
+      same = CFEqual (oldEntry, newRoutes);
+    }
+    
+    if (same)
+      return;
+  }
+  
+  CFArrayRef oldRoutes = copy_config_routes (ctx->oldConfig, serviceID);
+  
+  // Compare by route key, so this stays linear for large route sets
+  CFMutableDictionaryRef oldByKey = create_routes_by_key (oldRoutes);
+  CFMutableDictionaryRef newByKey = create_routes_by_key (newRoutes);
+  CFMutableArrayRef added = CFArrayCreateMutable (kCFAllocatorDefault, 0,
+                                                  &kCFTypeArrayCallBacks);
+  CFMutableArrayRef removed = CFArrayCreateMutable (kCFAllocatorDefault, 0,
+                                                    &kCFTypeArrayCallBacks);
+  struct missing_ctx addedCtx = { oldByKey, added };
+  struct missing_ctx removedCtx = { newByKey, removed };
+  
+  CFDictionaryApplyFunction (newByKey, collect_missing_routes, &addedCtx);
+  CFDictionaryApplyFunction (oldByKey, collect_missing_routes, &removedCtx);
+  
+  if (CFArrayGetCount (added) || CFArrayGetCount (removed)) {
+    CFTypeRef keys[2] = { CFSTR("added"), CFSTR("removed") };
+    CFTypeRef values[2] = { added, removed };
+    CFDictionaryRef serviceDiff
+      = CFDictionaryCreate(kCFAllocatorDefault,
+                           keys, values, 2,
+                           &kCFTypeDictionaryKeyCallBacks,
+                           &kCFTypeDictionaryValueCallBacks);
+    
+    // Kept as a blob, like resident routes; undo_service_diff() unpacks it
+    CFDataRef blob = create_blob (serviceDiff);
+    
+    if (blob) {
+      CFDictionarySetValue (ctx->diff, serviceID, blob);
+      CFRelease (blob);
+    }
+    CFRelease (serviceDiff);
+  }
+  
+  CFRelease (added);
+  CFRelease (removed);
+  CFRelease (oldByKey);
+  CFRelease (newByKey);
+  if (oldRoutes)
+    CFRelease (oldRoutes);
+}
+
+struct residency_ctx {
+  CFDictionaryRef diff;
+  CFMutableDictionaryRef config;
+};
+
+void
+store_service_routes (const void *key, const void *value, void *context)
+{
+  struct residency_ctx *ctx = (struct residency_ctx *)context;
+  CFStringRef serviceID = (CFStringRef)key;
+  CFTypeRef oldEntry = (currentConfig
+                        ? CFDictionaryGetValue (currentConfig, serviceID)
+                        : NULL);
+  
+  // Unchanged services keep whatever form they were in before
+  if (oldEntry && !(ctx->diff && CFDictionaryContainsKey (ctx->diff,
+                                                          serviceID))) {
+    CFDictionarySetValue (ctx->config, serviceID, oldEntry);
+    return;
+  }
+  
+  if (oldEntry && CFGetTypeID (oldEntry) == CFArrayGetTypeID ()) {
+    CFDictionarySetValue (ctx->config, serviceID, value);
+  } else if (CFGetTypeID (value) == CFArrayGetTypeID ()) {
+    CFDataRef blob = create_blob ((CFArrayRef)value);
+    
+    if (blob) {
+      CFDictionarySetValue (ctx->config, serviceID, blob);
+      CFRelease (blob);
+    }
+  }
+}
+
+void
+update_current_config (CFDictionaryRef newConfig, CFDictionaryRef diff)
+{
+  CFMutableDictionaryRef config
+    = CFDictionaryCreateMutable (kCFAllocatorDefault,
+                                 0,
+                                 &kCFTypeDictionaryKeyCallBacks,
+                                 &kCFTypeDictionaryValueCallBacks);
+  struct residency_ctx ctx = { diff, config };
+  
+  CFDictionaryApplyFunction (newConfig, store_service_routes, &ctx);
+  
+  // Any pf table digests for services whose routes changed are now stale
+  if (diff)
+    CFDictionaryApplyFunction (diff, forget_diff_pf_digests, NULL);
+  else
+    CFDictionaryRemoveAllValues (pfTableDigests);
+  
+  if (currentConfig)
+    CFRelease (currentConfig);
+  currentConfig = config;
+}
+
+void
+record_generation (void)
+{
+  // A simulated configuration never changes
+  if (simulatedConfig) {
+    if (!currentConfig)
+      update_current_config (simulatedConfig, NULL);
+    return;
+  }
+  
+  SCPreferencesSynchronize (systemConfPrefs);
+  SCPreferencesLock (systemConfPrefs, true);
+  CFDataRef signature = SCPreferencesGetSignature (systemConfPrefs);
+  
+  // Nothing to do unless the preferences have been written since last time
+  if (currentConfig && signature && configSignature
+      && CFEqual (signature, configSignature)) {
+    SCPreferencesUnlock (systemConfPrefs);
+    SCPreferencesSynchronize (systemConfPrefs);
+    return;
+  }
+  
+  if (configSignature)
+    CFRelease (configSignature);
+  configSignature = signature ? CFRetain (signature) : NULL;
+  
+  CFDictionaryRef newConfig = SCPreferencesGetValue (systemConfPrefs,
+                                                     kRoutesKey);
+  
+  if (newConfig)
+    CFRetain (newConfig);
+  else {
+    newConfig = CFDictionaryCreate (kCFAllocatorDefault, NULL, NULL, 0,
+                                    &kCFTypeDictionaryKeyCallBacks,
+                                    &kCFTypeDictionaryValueCallBacks);
+  }
+  SCPreferencesUnlock (systemConfPrefs);
+  
+  // Don't keep the whole preferences file cached between changes
+  SCPreferencesSynchronize (systemConfPrefs);
+  
+  // The first configuration we see is our baseline
+  if (!currentConfig) {
+    update_current_config (newConfig, NULL);
+    CFRelease (newConfig);
+    return;
+  }
+  
+  CFMutableSetRef services = CFSetCreateMutable (kCFAllocatorDefault,
+                                                 0,
+                                                 &kCFTypeSetCallBacks);
+  CFMutableDictionaryRef diff
+    = CFDictionaryCreateMutable (kCFAllocatorDefault,
+                                 0,
+                                 &kCFTypeDictionaryKeyCallBacks,
+                                 &kCFTypeDictionaryValueCallBacks);
+  struct diff_ctx ctx = { currentConfig, newConfig, diff };
+  
+  CFDictionaryApplyFunction (currentConfig, collect_service, services);
+  CFDictionaryApplyFunction (newConfig, collect_service, services);
+  CFSetApplyFunction (services, diff_service, &ctx);
+  
+  if (CFDictionaryGetCount (diff)) {
+    CFArrayInsertValueAtIndex (generationDiffs, 0, diff);
+    while (CFArrayGetCount (generationDiffs) > kMaxGenerations)
+      CFArrayRemoveValueAtIndex (generationDiffs,
+                                 CFArrayGetCount (generationDiffs) - 1);
+    
+    cf_fprintf (stderr,
+                CFSTR("staticrouted: recorded new configuration generation "
+                      "(%ld changed services, %ld generations kept).\n"),
+                CFDictionaryGetCount (diff),
+                CFArrayGetCount (generationDiffs));
+  }
+  
+  update_current_config (newConfig, diff);
+  
+  CFRelease (diff);
+  CFRelease (services);
+  CFRelease (newConfig);
+}
+
+struct undo_ctx {
+  CFMutableDictionaryRef config;
+  CFMutableSetRef services;
+};
+
+void
+undo_service_diff (const void *key, const void *value, void *context)
+{
+  struct undo_ctx *ctx = (struct undo_ctx *)context;
+  CFStringRef serviceID = (CFStringRef)key;
+  CFPropertyListRef serviceDiff
+    = CFPropertyListCreateWithData (kCFAllocatorDefault,
+                                    (CFDataRef)value,
+                                    kCFPropertyListImmutable,
+                                    NULL,
+                                    NULL);
+  
+  if (!serviceDiff)
+    return;
+  
+  CFArrayRef added = CFDictionaryGetValue (serviceDiff, CFSTR("added"));
+  CFArrayRef removed = CFDictionaryGetValue (serviceDiff, CFSTR("removed"));
+  CFArrayRef routes = copy_config_routes (ctx->config, serviceID);
+  CFIndex routeCount = routes ? CFArrayGetCount (routes) : 0;
+  CFMutableDictionaryRef addedByKey = create_routes_by_key (added);
+  CFMutableArrayRef newRoutes = CFArrayCreateMutable (kCFAllocatorDefault, 0,
+                                                      &kCFTypeArrayCallBacks);
+  
+  // Drop the routes that were added, keeping the order of the rest...
+  for (CFIndex n = 0; n < routeCount; ++n) {
+    CFDictionaryRef route = CFArrayGetValueAtIndex (routes, n);
+    CFStringRef routeKey = create_route_key (route);
+    
+    if (!CFDictionaryContainsKey (addedByKey, routeKey))
+      CFArrayAppendValue (newRoutes, route);
+    
+    CFRelease (routeKey);
+  }
+  
+  // ...and put back the ones that were removed
+  CFArrayAppendArray (newRoutes, removed,
+                      CFRangeMake (0, CFArrayGetCount (removed)));
+  
+  CFDictionarySetValue (ctx->config, serviceID, newRoutes);
+  CFSetAddValue (ctx->services, serviceID);
+  
+  CFRelease (newRoutes);
+  CFRelease (addedByKey);
+  if (routes)
+    CFRelease (routes);
+  CFRelease (serviceDiff);
+}
+
+struct write_ctx {
+  CFDictionaryRef config;
+  CFMutableDictionaryRef staticRoutes;
+};
+
+void
+write_service_routes (const void *value, void *context)
+{
+  struct write_ctx *ctx = (struct write_ctx *)context;
+  CFStringRef serviceID = (CFStringRef)value;
+  
+  CFDictionarySetValue (ctx->staticRoutes, serviceID,
+                        CFDictionaryGetValue (ctx->config, serviceID));
+}
+
+bool
+rollback_generations (CFIndex generations, CFStringRef *pMessage)
+{
+  // Make sure we know about the configuration we are rolling back from
+  record_generation ();
+  
+  CFIndex available = CFArrayGetCount (generationDiffs);
+  
+  if (generations < 1 || generations > available) {
+    *pMessage = CFStringCreateWithFormat (kCFAllocatorDefault,
+                                          NULL,
+                                          CFSTR("cannot roll back %ld "
+                                                "generations; %ld available"),
+                                          (long)generations,
+                                          (long)available);
+    return false;
+  }
+  
+  // Apply the inverse of each diff in turn, newest first
+  CFMutableDictionaryRef target
+    = CFDictionaryCreateMutableCopy (kCFAllocatorDefault, 0, currentConfig);
+  CFMutableSetRef services = CFSetCreateMutable (kCFAllocatorDefault,
+                                                 0,
+                                                 &kCFTypeSetCallBacks);
+  struct undo_ctx ctx = { target, services };
+  
+  for (CFIndex n = 0; n < generations; ++n)
+    CFDictionaryApplyFunction (CFArrayGetValueAtIndex (generationDiffs, n),
+                               undo_service_diff, &ctx);
+  
+  /* Write the affected services back in one go; the rest of the stored
+     configuration already matches currentConfig */
+  bool ok = true;
+  
+  SCPreferencesSynchronize (systemConfPrefs);
+  if (!SCPreferencesLock (systemConfPrefs, true)) {
+    *pMessage = CFStringCreateWithFormat (kCFAllocatorDefault,
+                                          NULL,
+                                          CFSTR("cannot lock system "
+                                                "configuration database"));
+    CFRelease (services);
+    CFRelease (target);
+    return false;
+  }
+  
+  /* If someone has changed the configuration since we recorded it, our diffs
+     no longer describe what is stored, and writing target would lose their
+     change */
+  CFDataRef signature = SCPreferencesGetSignature (systemConfPrefs);
+  
+  if (!signature || !configSignature || !CFEqual (signature, configSignature)) {
+    SCPreferencesUnlock (systemConfPrefs);
+    SCPreferencesSynchronize (systemConfPrefs);
+    *pMessage = CFStringCreateWithFormat (kCFAllocatorDefault,
+                                          NULL,
+                                          CFSTR("configuration changed, "
+                                                "retry"));
+    CFRelease (services);
+    CFRelease (target);
+    return false;
+  }
+  
+  {
+    CFDictionaryRef oldStaticRoutes = SCPreferencesGetValue (systemConfPrefs,
+                                                             kRoutesKey);
+    CFMutableDictionaryRef staticRoutes;
+    
+    if (oldStaticRoutes) {
+      staticRoutes = CFDictionaryCreateMutableCopy (kCFAllocatorDefault, 0,
+                                                    oldStaticRoutes);
+    } else {
+      staticRoutes = CFDictionaryCreateMutable (kCFAllocatorDefault, 0,
+                                                &kCFTypeDictionaryKeyCallBacks,
+                                                &kCFTypeDictionaryValueCallBacks);
+    }
+    
+    struct write_ctx wctx = { target, staticRoutes };
+    CFSetApplyFunction (services, write_service_routes, &wctx);
+    
+    if (!SCPreferencesSetValue (systemConfPrefs, kRoutesKey, staticRoutes)
+        || !SCPreferencesCommitChanges (systemConfPrefs)
+        || !SCPreferencesApplyChanges (systemConfPrefs))
+      ok = false;
+    else {
+      // Our own write isn't a new generation
+      signature = SCPreferencesGetSignature (systemConfPrefs);
+      
+      CFRelease (configSignature);
+      configSignature = signature ? CFRetain (signature) : NULL;
+    }
+    
+    CFRelease (staticRoutes);
+  }
+  SCPreferencesUnlock (systemConfPrefs);
+  SCPreferencesSynchronize (systemConfPrefs);
+  
+  if (!ok) {
+    *pMessage = CFStringCreateWithFormat (kCFAllocatorDefault,
+                                          NULL,
+                                          CFSTR("cannot write rolled back "
+                                                "configuration to system "
+                                                "configuration database"));
+    CFRelease (services);
+    CFRelease (target);
+    return false;
+  }
+  
+  for (CFIndex n = 0; n < generations; ++n)
+    CFArrayRemoveValueAtIndex (generationDiffs, 0);
+  
+  CFRelease (currentConfig);
+  currentConfig = target;
+  CFSetApplyFunction (services, forget_pf_digests, NULL);
+  
+  cf_fprintf (stderr,
+              CFSTR("staticrouted: rolled back %ld generations "
+                    "(%ld services affected).\n"),
+              (long)generations,
+              CFSetGetCount (services));
+  
+  // Queue up the route changes and push them to the kernel straight away
+  CFSetApplyFunction (services, install_routes, NULL);
+  
+  flush_route_ops_now ();
+  
+  CFRelease (services);
+  
+  *pMessage = CFStringCreateWithFormat (kCFAllocatorDefault,
+                                        NULL,
+                                        CFSTR("rolled back %ld generations"),
+                                        (long)generations);
+  return true;
+}
+
+void
+handle_rollback_request (void)
+{
+  CFDictionaryRef request = SCDynamicStoreCopyValue (dynamicStore,
+                                                     kRollbackKey);
+  
+  // We also get notified when we remove a request we have dealt with
+  if (!request)
+    return;
+  
+  CFNumberRef generationsNum = CFDictionaryGetValue (request,
+                                                     CFSTR("generations"));
+  CFTypeRef requestID = CFDictionaryGetValue (request, CFSTR("request"));
+  CFIndex generations = 1;
+  CFStringRef message = NULL;
+  
+  if (generationsNum)
+    CFNumberGetValue (generationsNum, kCFNumberCFIndexType, &generations);
+  
+  /* A long rollback can take a while to apply; tell staticroute we are
+     working on it so that it doesn't give up on us */
+  if (requestID) {
+    CFStringRef inProgressKeys[] = { CFSTR("request"), CFSTR("inProgress") };
+    CFTypeRef inProgressValues[] = { requestID, kCFBooleanTrue };
+    CFDictionaryRef inProgress
+      = CFDictionaryCreate (kCFAllocatorDefault,
+                            (const void **)inProgressKeys,
+                            (const void **)inProgressValues, 2,
+                            &kCFTypeDictionaryKeyCallBacks,
+                            &kCFTypeDictionaryValueCallBacks);
+    
+    /* Temporary, so that if we die part way through, staticroute isn't left
+       waiting for ever */
+    SCDynamicStoreRemoveValue (dynamicStore, kRollbackResultKey);
+    SCDynamicStoreAddTemporaryValue (dynamicStore, kRollbackResultKey,
+                                     inProgress);
+    CFRelease (inProgress);
+  }
+  
+  int status = rollback_generations (generations, &message) ? 0 : 1;
+  
+  if (status)
+    cf_fprintf (stderr, CFSTR("staticrouted: %@.\n"), message);
+  
+  // Let staticroute know how it went
+  CFMutableDictionaryRef result
+    = CFDictionaryCreateMutable (kCFAllocatorDefault,
+                                 0,
+                                 &kCFTypeDictionaryKeyCallBacks,
+                                 &kCFTypeDictionaryValueCallBacks);
+  CFNumberRef statusNum = CFNumberCreate (kCFAllocatorDefault,
+                                          kCFNumberIntType, &status);
+  
+  if (requestID)
+    CFDictionarySetValue (result, CFSTR("request"), requestID);
+  CFDictionarySetValue (result, CFSTR("status"), statusNum);
+  CFDictionarySetValue (result, CFSTR("message"), message);
+  
+  SCDynamicStoreSetValue (dynamicStore, kRollbackResultKey, result);
+  
+  /* Someone may have posted another request while we were busy; leave that
+     one for its own notification */
+  CFDictionaryRef currentRequest = SCDynamicStoreCopyValue (dynamicStore,
+                                                            kRollbackKey);
+  
+  if (currentRequest) {
+    if (CFEqual (currentRequest, request))
+      SCDynamicStoreRemoveValue (dynamicStore, kRollbackKey);
+    CFRelease (currentRequest);
+  }
+  
+  CFRelease (statusNum);
+  CFRelease (result);
+  CFRelease (message);
+  CFRelease (request);
+}
+
+/* Hash the contents of a pf table, so we can tell whether it needs to be
+   reloaded without keeping a copy of it in the dynamic store */
+SInt64
+digest_data (CFDataRef data)
+{
+  const UInt8 *ptr = CFDataGetBytePtr (data);
+  CFIndex len = CFDataGetLength (data);
+  UInt64 hash = 0xcbf29ce484222325ull;
+  
+  while (len--) {
+    hash ^= *ptr++;
+    hash *= 0x100000001b3ull;
+  }
+  
+  return (SInt64)hash;
+}
+
+/* Build the contents of a pf table, one prefix per line */
+CFDataRef
+create_pf_table_data (CFArrayRef routes,
+                      CFStringRef addressFamily,
+                      int *pPrefixCount)
+{
+  CFMutableDataRef prefixes = CFDataCreateMutable (kCFAllocatorDefault, 0);
+  CFIndex routeCount = CFArrayGetCount (routes);
+  int prefixCount = 0;
+  
+  for (CFIndex n = 0; n < routeCount; ++n) {
+    CFDictionaryRef route = CFArrayGetValueAtIndex (routes, n);
+    CFStringRef family = CFDictionaryGetValue (route, CFSTR("addressFamily"));
+    CFStringRef address = CFDictionaryGetValue (route, CFSTR("address"));
+    CFNumberRef prefixLen = CFDictionaryGetValue (route,
+                                                  CFSTR("prefixLength"));
+    
+    if (CFStringCompare (family, addressFamily, 0) != kCFCompareEqualTo)
+      continue;
+    
+    UInt8 lineBuf[256];
+    CFIndex usedBuf = 0;
+    CFStringRef line = CFStringCreateWithFormat (kCFAllocatorDefault,
+                                                 NULL,
+                                                 CFSTR("%@/%@\n"),
+                                                 address,
+                                                 prefixLen);
+    
+    CFStringGetBytes (line, CFRangeMake (0, CFStringGetLength (line)),
+                      kCFStringEncodingUTF8, '?', false, lineBuf,
+                      sizeof (lineBuf), &usedBuf);
+    CFDataAppendBytes (prefixes, lineBuf, usedBuf);
+    CFRelease (line);
+    ++prefixCount;
+  }
+  
+  if (pPrefixCount)
+    *pPrefixCount = prefixCount;
+  
+  return prefixes;
+}
+
+void
+forget_pf_digests (const void *value, void *context)
+{
+  CFDictionaryRemoveValue (pfTableDigests, value);
+}
+
+void
+forget_diff_pf_digests (const void *key, const void *value, void *context)
+{
+  forget_pf_digests (key, context);
+}
+
+/* Bring one table in an anchor up to date, updating its entry in tables.
+   A table that is wanted but whose service is down is kept, along with its
+   digest, but is left without a router so that it gets no rules; it is only
+   removed once the family no longer needs a table.  Returns false if pfctl
+   failed, in which case the caller must not record the new state; sets
+   *pRulesChanged if the anchor's rules need reloading. */
+bool
+setup_pf_table (CFStringRef anchor,
+                CFMutableDictionaryRef tables,
+                CFStringRef serviceID,
+                CFStringRef addressFamily,
+                CFArrayRef routes,
+                bool wantTable,
+                CFStringRef router,
+                CFStringRef interface,
+                bool *pRulesChanged)
+{
+  CFDictionaryRef oldTable = CFDictionaryGetValue (tables, addressFamily);
+  char tableBuf[16];
+  
+  CFStringGetCString (addressFamily, tableBuf, sizeof (tableBuf),
+                      kCFStringEncodingUTF8);
+  
+  if (!wantTable) {
+    if (!oldTable)
+      return true;
+    
+    cf_fprintf (stderr,
+                CFSTR("staticrouted: removing pf table %@ from anchor %@.\n"),
+                addressFamily, anchor);
+    if (!do_pfctl (NULL, anchor, "-t", tableBuf, "-T", "kill", NULL))
+      return false;
+    
+    CFDictionaryRemoveValue (tables, addressFamily);
+    *pRulesChanged = true;
+    return true;
+  }
+  
+  if (!router || !interface) {
+    if (!oldTable || !CFDictionaryContainsKey (oldTable, CFSTR("router")))
+      return true;
+    
+    // Keep the table, but stop routing to it
+    CFTypeRef keys[1] = { CFSTR("digest") };
+    CFTypeRef values[1] = { CFDictionaryGetValue (oldTable, CFSTR("digest")) };
+    CFDictionaryRef table = CFDictionaryCreate(kCFAllocatorDefault,
+                                               keys, values, 1,
+                                               &kCFTypeDictionaryKeyCallBacks,
+                                               &kCFTypeDictionaryValueCallBacks);
+    CFDictionarySetValue (tables, addressFamily, table);
+    CFRelease (table);
+    *pRulesChanged = true;
+    return true;
+  }
+  
+  // Use the cached digest if the routes haven't changed since we made it
+  CFMutableDictionaryRef digests
+    = (CFMutableDictionaryRef)CFDictionaryGetValue (pfTableDigests, serviceID);
+  CFNumberRef digestNum = (digests
+                           ? CFDictionaryGetValue (digests, addressFamily)
+                           : NULL);
+  CFDataRef prefixes = NULL;
+  int prefixCount = 0;
+  SInt64 digest = 0;
+  SInt64 oldDigest = 0;
+  
+  if (digestNum)
+    CFRetain (digestNum);
+  else {
+    prefixes = create_pf_table_data (routes, addressFamily, &prefixCount);
+    digest = digest_data (prefixes);
+    digestNum = CFNumberCreate (kCFAllocatorDefault,
+                                kCFNumberSInt64Type, &digest);
+    
+    if (!digests) {
+      digests = CFDictionaryCreateMutable (kCFAllocatorDefault,
+                                           0,
+                                           &kCFTypeDictionaryKeyCallBacks,
+                                           &kCFTypeDictionaryValueCallBacks);
+      CFDictionarySetValue (pfTableDigests, serviceID, digests);
+      CFRelease (digests);
+    }
+    CFDictionarySetValue (digests, addressFamily, digestNum);
+  }
+  
+  CFNumberGetValue (digestNum, kCFNumberSInt64Type, &digest);
+  if (oldTable)
+    CFNumberGetValue (CFDictionaryGetValue (oldTable, CFSTR("digest")),
+                      kCFNumberSInt64Type, &oldDigest);
+  
+  // Replace the table contents in a single pfctl transaction
+  if (!oldTable || digest != oldDigest) {
+    if (!prefixes)
+      prefixes = create_pf_table_data (routes, addressFamily, &prefixCount);
+    
+    cf_fprintf (stderr,
+                CFSTR("staticrouted: loading %d prefixes into pf table %@ in "
+                      "anchor %@.\n"),
+                prefixCount, addressFamily, anchor);
+    
+    if (!do_pfctl (prefixes, anchor,
+                   "-t", tableBuf, "-T", "replace", "-f", "-", NULL)) {
+      CFRelease (prefixes);
+      CFRelease (digestNum);
+      return false;
+    }
+  }
+  
+  if (prefixes)
+    CFRelease (prefixes);
+  
+  CFStringRef oldRouter = (oldTable
+                           ? CFDictionaryGetValue (oldTable, CFSTR("router"))
+                           : NULL);
+  CFStringRef oldInterface = (oldTable
+                              ? CFDictionaryGetValue (oldTable,
+                                                      CFSTR("interface"))
+                              : NULL);
+  
+  if (!oldRouter || !CFEqual (router, oldRouter)
+      || !oldInterface || !CFEqual (interface, oldInterface))
+    *pRulesChanged = true;
+  
+  CFTypeRef keys[3] = {
+    CFSTR("router"),
+    CFSTR("interface"),
+    CFSTR("digest")
+  };
+  CFTypeRef values[3] = { router, interface, digestNum };
+  CFDictionaryRef table = CFDictionaryCreate(kCFAllocatorDefault,
+                                             keys, values, 3,
+                                             &kCFTypeDictionaryKeyCallBacks,
+                                             &kCFTypeDictionaryValueCallBacks);
+  CFDictionarySetValue (tables, addressFamily, table);
+  CFRelease (table);
+  CFRelease (digestNum);
+  
+  return true;
+}
+
+bool
+load_pf_rules (CFStringRef anchor, CFDictionaryRef tables)
+{
+  bool ok;
+  CFMutableStringRef rules = CFStringCreateMutable (kCFAllocatorDefault, 0);
+  CFStringRef families[2] = { CFSTR("IPv4"), CFSTR("IPv6") };
+  const char *pfFamilies[2] = { "inet", "inet6" };
+  
+  /* The kernel picks the source address before route-to ever sees the
+     packet, and with no route for these prefixes it will be the address of
+     the default route's interface; translate it to the service interface's
+     address, or replies (over a VPN, say) will never find their way back.
+     
+     The pass rules are stateless, so that when the router changes, traffic
+     moves over as soon as the new rules are loaded.  They are not quick, so
+     that the administrator's own pf rules still apply to this traffic. */
+  for (unsigned n = 0; n < 2; ++n) {
+    CFDictionaryRef table = CFDictionaryGetValue (tables, families[n]);
+    
+    // Tables for a service that is down get no rules
+    if (!table || !CFDictionaryContainsKey (table, CFSTR("router")))
+      continue;
+    
+    CFStringRef interface = CFDictionaryGetValue (table, CFSTR("interface"));
+    
+    CFStringAppendFormat (rules, NULL,
+                          CFSTR("nat on %@ %s from ! (%@) to <%@> -> (%@)\n"),
+                          interface,
+                          pfFamilies[n],
+                          interface,
+                          families[n],
+                          interface);
+  }
+  
+  for (unsigned n = 0; n < 2; ++n) {
+    CFDictionaryRef table = CFDictionaryGetValue (tables, families[n]);
+    
+    // Tables for a service that is down get no rules
+    if (!table || !CFDictionaryContainsKey (table, CFSTR("router")))
+      continue;
+    
+    CFStringAppendFormat (rules, NULL,
+                          CFSTR("pass out route-to (%@ %@) %s "
+                                "from any to <%@> no state\n"),
+                          CFDictionaryGetValue (table, CFSTR("interface")),
+                          CFDictionaryGetValue (table, CFSTR("router")),
+                          pfFamilies[n],
+                          families[n]);
+  }
+  
+  /* Loading replaces all of the anchor's rules, but unlike "-F all" leaves
+     its tables alone, so we do this even when there are no rules */
+  CFDataRef ruleData
+    = CFStringCreateExternalRepresentation (kCFAllocatorDefault,
+                                            rules,
+                                            kCFStringEncodingUTF8,
+                                            '?');
+  
+  if (!CFStringGetLength (rules)) {
+    cf_fprintf (stderr,
+                CFSTR("staticrouted: clearing rules in pf anchor %@.\n"),
+                anchor);
+  } else {
+    cf_fprintf (stderr,
+                CFSTR("staticrouted: loading rules into pf anchor %@.\n"),
+                anchor);
+  }
+  
+  ok = do_pfctl (ruleData, anchor, "-f", "-", NULL);
+  CFRelease (ruleData);
+  CFRelease (rules);
+  
+  return ok;
+}
+
+void
+setup_pf_tables (CFStringRef serviceID,
+                 CFArrayRef routes,
+                 CFStringRef ipv4Router,
+                 CFStringRef ipv4Interface,
+                 bool ipv4Table,
+                 CFStringRef ipv6Router,
+                 CFStringRef ipv6Interface,
+                 bool ipv6Table)
+{
+  CFStringRef tableKey
+    = CFStringCreateWithFormat (kCFAllocatorDefault,
+                                NULL,
+                                CFSTR("State:/com.coriolis-systems.StaticRoutes/Table/%@"),
+                                serviceID);
+  CFDictionaryRef oldTables = store_copy_value (tableKey);
+  
+  /* Nothing to do if we have never used pf for this service; tables are
+     only loaded once the service first comes up */
+  if (!oldTables && !(ipv4Router && ipv4Table) && !(ipv6Router && ipv6Table)) {
+    CFRelease (tableKey);
+    return;
+  }
+  
+  /* If a family is moving from a table back to kernel routes, the routes
+     have only just been queued; push them out before the table goes, so
+     that the prefixes are never left without a route */
+  if (oldTables
+      && ((ipv4Router && !ipv4Table
+           && CFDictionaryContainsKey (oldTables, CFSTR("IPv4")))
+          || (ipv6Router && !ipv6Table
+              && CFDictionaryContainsKey (oldTables, CFSTR("IPv6")))))
+    flush_route_ops_now ();
+  
+  CFMutableDictionaryRef tables;
+  
+  if (oldTables)
+    tables = CFDictionaryCreateMutableCopy (kCFAllocatorDefault, 0, oldTables);
+  else {
+    tables = CFDictionaryCreateMutable (kCFAllocatorDefault,
+                                        0,
+                                        &kCFTypeDictionaryKeyCallBacks,
+                                        &kCFTypeDictionaryValueCallBacks);
+  }
+  
+  CFStringRef anchor = CFStringCreateWithFormat (kCFAllocatorDefault,
+                                                 NULL,
+                                                 CFSTR("%@%@"),
+                                                 kPFAnchorPrefix,
+                                                 serviceID);
+  bool rulesChanged = false;
+  bool ok = true;
+  
+  if (!setup_pf_table (anchor, tables, serviceID, CFSTR("IPv4"), routes,
+                       ipv4Table, ipv4Router, ipv4Interface,
+                       &rulesChanged))
+    ok = false;
+  if (!setup_pf_table (anchor, tables, serviceID, CFSTR("IPv6"), routes,
+                       ipv6Table, ipv6Router, ipv6Interface,
+                       &rulesChanged))
+    ok = false;
+  
+  // A router change, or the service going down, only touches the rules
+  if (ok && rulesChanged && !load_pf_rules (anchor, tables))
+    ok = false;
+  
+  /* Only record what pf actually has, so that a failure is retried on the
+     next pass rather than being mistaken for a table that is up to date */
+  if (ok && (!oldTables || !CFEqual (oldTables, tables))) {
+    if (CFDictionaryGetCount (tables))
+      store_set_value (tableKey, tables);
+    else
+      store_remove_value (tableKey);
+  }
+  
+  if (oldTables)
+    CFRelease (oldTables);
+  CFRelease (anchor);
+  CFRelease (tables);
+  CFRelease (tableKey);
+}
+
+bool
+remove_route (CFStringRef address,
+              CFNumberRef prefixLen,
+              CFStringRef router)
+{
+  return do_route ("delete", address, prefixLen, router);
+}
+
+bool
+add_route (CFStringRef address,
+           CFNumberRef prefixLen,
+           CFStringRef router)
+{
+  return do_route ("add", address, prefixLen, router);
+}
+
+bool
+change_route (CFStringRef address,
+              CFNumberRef prefixLen,
+              CFStringRef router)
+{
+  return do_route ("change", address, prefixLen, router);
+}
+
+bool
+do_route (const char *cmd,
+          CFStringRef address,
+          CFNumberRef prefixLen,
+          CFStringRef router)
+{
+  UInt8 routerBuf[256];
+  UInt8 destBuf[256];
+  CFIndex usedBuf = 0;
+  int prefix = 0;
+  
+  // Grab the prefix length as an int
+  CFNumberGetValue (prefixLen, kCFNumberIntType, &prefix);
+  
+  // Grab the router address as a UTF-8 string
+  usedBuf = 0;
+  CFStringGetBytes (router, CFRangeMake (0, CFStringGetLength (router)),
+                    kCFStringEncodingUTF8, '?', false, routerBuf,
+                    sizeof (routerBuf), &usedBuf);
+  routerBuf[usedBuf] = '\0';
+  
+  // Grab the address as a UTF-8 string and tack /prefix-len to the end
+  usedBuf = 0;
+  CFStringGetBytes (address, CFRangeMake (0, CFStringGetLength (address)),
+                    kCFStringEncodingUTF8, '?', false, destBuf,
+                    sizeof (destBuf), &usedBuf);
+  sprintf ((char *)destBuf + usedBuf, "/%d", prefix);
+  
+  // Build our route command
+  char * const argv[] = {
+    "/sbin/route",
+    (char *)cmd,
+    (char *)destBuf,
+    (char *)routerBuf,
+    NULL
+  };
+  
+  return run_command ("/sbin/route", argv, NULL);
+}
+
+bool
+do_pfctl (CFDataRef input, CFStringRef anchor, ...)
+{
+  char anchorBuf[256];
+  char *argv[16];
+  unsigned argc = 0;
+  const char *arg;
+  va_list val;
+  
+  CFStringGetCString (anchor, anchorBuf, sizeof (anchorBuf),
+                      kCFStringEncodingUTF8);
+  
+  // Build our pfctl command from the NULL-terminated argument list
+  argv[argc++] = "/sbin/pfctl";
+  argv[argc++] = "-q";
+  argv[argc++] = "-a";
+  argv[argc++] = anchorBuf;
+  
+  va_start (val, anchor);
+  while ((arg = va_arg (val, const char *))
+         && argc < sizeof (argv) / sizeof (argv[0]) - 1)
+    argv[argc++] = (char *)arg;
+  va_end (val);
+  
+  argv[argc] = NULL;
+  
+  return run_command ("/sbin/pfctl", argv, input);
+}
+
+bool
+run_command (const char *path, char * const argv[], CFDataRef input)
+{
+  // When replaying events, just count what we would have done
+  if (simulatedStore) {
+    if (strcmp (path, "/sbin/pfctl") == 0)
+      ++simulatedPfctlCommands;
+    else
+      ++simulatedRouteCommands;
+    return true;
+  }
+  
+  // Spawn it
+  pid_t childPid;
+  posix_spawn_file_actions_t actions;
+  int fds[2] = { -1, -1 };
+  
+  if (input && pipe (fds) < 0) {
+    cf_fprintf (stderr,
+                CFSTR("staticrouted: unable to create pipe for %s "
+                      "- errno %d: %s.\n"),
+                path,
+                errno,
+                strerror (errno));
+    return false;
+  }
+  
+  posix_spawn_file_actions_init (&actions);
+  posix_spawn_file_actions_addopen (&actions, STDOUT_FILENO,
+                                    "/dev/null", O_RDWR, 0644);
+  
+  if (input) {
+    posix_spawn_file_actions_adddup2 (&actions, fds[0], STDIN_FILENO);
+    posix_spawn_file_actions_addclose (&actions, fds[0]);
+    posix_spawn_file_actions_addclose (&actions, fds[1]);
+  }
+  
+  if (posix_spawn (&childPid, path,
+                   &actions, NULL,
+                   argv, NULL) < 0) {
+    posix_spawn_file_actions_destroy (&actions);
+    cf_fprintf (stderr,
+                CFSTR("staticrouted: unable to spawn %s "
+                      "- errno %d: %s.\n"),
+                path,
+                errno,
+                strerror (errno));
+    if (input) {
+      close (fds[0]);
+      close (fds[1]);
+    }
+    return false;
+  }
+  
+  posix_spawn_file_actions_destroy (&actions);
+  
+  if (input) {
+    const UInt8 *ptr = CFDataGetBytePtr (input);
+    CFIndex len = CFDataGetLength (input);
+    
+    close (fds[0]);
+    
+    while (len) {
+      ssize_t written = write (fds[1], ptr, len);
+      
+      if (written < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      
+      ptr += written;
+      len -= written;
+    }
+    
+    close (fds[1]);
+  }
+
+  int status = 0;
+  
+  waitpid (childPid, &status, 0);
+  
+  if (WIFSIGNALED (status)) {
+    cf_fprintf (stderr,
+                CFSTR ("staticrouted: %s appears to have been "
+                       "killed - signal %d.\n"),
+                path,
                 WTERMSIG (status));
     return false;
   }
   
   if (WEXITSTATUS (status) != 0) {
     cf_fprintf (stderr,
-                CFSTR ("staticrouted: /sbin/route failed with code %d.\n"),
+                CFSTR ("staticrouted: %s failed with code %d.\n"),
+                path,
                 WEXITSTATUS (status));
     return false;
   }
@@ -502,3 +2031,181 @@ do_route (const char *cmd,
   return true;
 }
 
+CFPropertyListRef
+load_property_list (const char *path)
+{
+  FILE *fp = fopen (path, "r");
+  
+  if (!fp)
+    return NULL;
+  
+  CFMutableDataRef data = CFDataCreateMutable (kCFAllocatorDefault, 0);
+  UInt8 buffer[4096];
+  size_t len;
+  
+  while ((len = fread (buffer, 1, sizeof (buffer), fp)) > 0)
+    CFDataAppendBytes (data, buffer, len);
+  
+  fclose (fp);
+  
+  CFPropertyListRef plist
+    = CFPropertyListCreateWithData (kCFAllocatorDefault,
+                                    data,
+                                    kCFPropertyListImmutable,
+                                    NULL,
+                                    NULL);
+  CFRelease (data);
+  
+  return plist;
+}
+
+int
+run_simulation (const char *eventsPath, const char *routesPath)
+{
+  FILE *fp = fopen (eventsPath, "r");
+  
+  if (!fp) {
+    cf_fprintf (stderr,
+                CFSTR("staticrouted: unable to open %s - errno %d: %s.\n"),
+                eventsPath, errno, strerror (errno));
+    return 1;
+  }
+  
+  if (routesPath) {
+    simulatedConfig = load_property_list (routesPath);
+    
+    if (!simulatedConfig
+        || CFGetTypeID (simulatedConfig) != CFDictionaryGetTypeID ()) {
+      cf_fprintf (stderr,
+                  CFSTR("staticrouted: %s is not a valid routes property "
+                        "list.\n"),
+                  routesPath);
+      if (simulatedConfig)
+        CFRelease (simulatedConfig);
+      fclose (fp);
+      return 1;
+    }
+  }
+  
+  vclock_use_simulated (0);
+  simulatedStore = CFDictionaryCreateMutable (kCFAllocatorDefault,
+                                              0,
+                                              &kCFTypeDictionaryKeyCallBacks,
+                                              &kCFTypeDictionaryValueCallBacks);
+  pendingRouteOps = CFDictionaryCreateMutable (kCFAllocatorDefault,
+                                               0,
+                                               &kCFTypeDictionaryKeyCallBacks,
+                                               &kCFTypeDictionaryValueCallBacks);
+  generationDiffs = CFArrayCreateMutable (kCFAllocatorDefault, 0,
+                                          &kCFTypeArrayCallBacks);
+  pfTableDigests = CFDictionaryCreateMutable (kCFAllocatorDefault,
+                                              0,
+                                              &kCFTypeDictionaryKeyCallBacks,
+                                              &kCFTypeDictionaryValueCallBacks);
+  
+  CFAbsoluteTime started = CFAbsoluteTimeGetCurrent ();
+  char line[1024];
+  unsigned lineNo = 0;
+  long eventCount = 0;
+  int ret = 0;
+  
+  while (fgets (line, sizeof (line), fp)) {
+    double when;
+    char service[256], family[16], router[256], interface[64];
+    
+    ++lineNo;
+    
+    if (line[0] == '#' || line[0] == '\n' || line[0] == '\0')
+      continue;
+    
+    interface[0] = '\0';
+    if (sscanf (line, "%lf %255s %15s %255s %63s",
+                &when, service, family, router, interface) < 4) {
+      cf_fprintf (stderr,
+                  CFSTR("staticrouted: %s:%u: bad event.\n"),
+                  eventsPath, lineNo);
+      ret = 1;
+      break;
+    }
+    
+    if (when < vclock_now ()) {
+      cf_fprintf (stderr,
+                  CFSTR("staticrouted: %s:%u: event is out of order.\n"),
+                  eventsPath, lineNo);
+      ret = 1;
+      break;
+    }
+    
+    // Let any timers that fall due before this event fire first
+    vclock_advance (when - vclock_now ());
+    
+    CFStringRef key = CFStringCreateWithFormat (kCFAllocatorDefault,
+                                                NULL,
+                                                CFSTR("State:/Network/Service/%s/%s"),
+                                                service,
+                                                family);
+    
+    if (strcmp (router, "-") == 0)
+      store_remove_value (key);
+    else {
+      CFMutableDictionaryRef state
+        = CFDictionaryCreateMutable (kCFAllocatorDefault,
+                                     0,
+                                     &kCFTypeDictionaryKeyCallBacks,
+                                     &kCFTypeDictionaryValueCallBacks);
+      CFStringRef routerString
+        = CFStringCreateWithCString (kCFAllocatorDefault, router,
+                                     kCFStringEncodingUTF8);
+      
+      CFDictionarySetValue (state, CFSTR("Router"), routerString);
+      CFRelease (routerString);
+      
+      if (interface[0]) {
+        CFStringRef interfaceString
+          = CFStringCreateWithCString (kCFAllocatorDefault, interface,
+                                       kCFStringEncodingUTF8);
+        CFDictionarySetValue (state, CFSTR("InterfaceName"), interfaceString);
+        CFRelease (interfaceString);
+      }
+      
+      store_set_value (key, state);
+      CFRelease (state);
+    }
+    
+    CFArrayRef keys = CFArrayCreate (kCFAllocatorDefault,
+                                     (const void **)&key, 1,
+                                     &kCFTypeArrayCallBacks);
+    dynamic_store_changed (NULL, keys, NULL);
+    CFRelease (keys);
+    CFRelease (key);
+    
+    ++eventCount;
+  }
+  
+  fclose (fp);
+  
+  // Let anything still queued through
+  vclock_advance (kRouteOpsDelay);
+  
+  if (!ret) {
+    cf_printf (CFSTR("Replayed %ld events covering %.1f simulated seconds in "
+                     "%.2f seconds.\n"),
+               eventCount, vclock_now () - kRouteOpsDelay,
+               CFAbsoluteTimeGetCurrent () - started);
+    cf_printf (CFSTR("%ld route commands, %ld pfctl commands.\n"),
+               simulatedRouteCommands, simulatedPfctlCommands);
+  }
+  
+  if (currentConfig)
+    CFRelease (currentConfig);
+  if (configSignature)
+    CFRelease (configSignature);
+  if (simulatedConfig)
+    CFRelease (simulatedConfig);
+  CFRelease (generationDiffs);
+  CFRelease (pfTableDigests);
+  CFRelease (pendingRouteOps);
+  CFRelease (simulatedStore);
+  
+  return ret;
+}
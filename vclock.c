@@ -0,0 +1,148 @@
+/*
+ *  vclock.c
+ *  staticrouted
+ *
+ *  Copyright 2010 Coriolis Systems Limited. All rights reserved.
+ *
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "vclock.h"
+
+struct vclock_timer {
+  CFAbsoluteTime fireTime;
+  vclock_callback_t callback;
+  void *info;
+  CFRunLoopTimerRef cfTimer;
+  struct vclock_timer *next;
+};
+
+static bool simulated = false;
+static CFAbsoluteTime simulatedNow = 0;
+
+// Pending simulated timers, sorted by fire time
+static struct vclock_timer *simulatedTimers = NULL;
+
+void
+vclock_use_simulated (CFAbsoluteTime start)
+{
+  simulated = true;
+  simulatedNow = start;
+}
+
+bool
+vclock_is_simulated (void)
+{
+  return simulated;
+}
+
+CFAbsoluteTime
+vclock_now (void)
+{
+  if (simulated)
+    return simulatedNow;
+  
+  return CFAbsoluteTimeGetCurrent ();
+}
+
+static void
+fire_cf_timer (CFRunLoopTimerRef cfTimer, void *info)
+{
+  struct vclock_timer *timer = (struct vclock_timer *)info;
+  vclock_callback_t callback = timer->callback;
+  void *callbackInfo = timer->info;
+  
+  // The timer is one-shot, so it has already been invalidated
+  CFRelease (timer->cfTimer);
+  free (timer);
+  
+  callback (callbackInfo);
+}
+
+vclock_timer_t
+vclock_schedule (CFTimeInterval delay,
+                 vclock_callback_t callback,
+                 void *info)
+{
+  struct vclock_timer *timer
+    = (struct vclock_timer *)malloc (sizeof (struct vclock_timer));
+  
+  timer->fireTime = vclock_now () + delay;
+  timer->callback = callback;
+  timer->info = info;
+  timer->cfTimer = NULL;
+  timer->next = NULL;
+  
+  if (simulated) {
+    struct vclock_timer **pptr = &simulatedTimers;
+    
+    // Timers due at the same time fire in the order they were scheduled
+    while (*pptr && (*pptr)->fireTime <= timer->fireTime)
+      pptr = &(*pptr)->next;
+    
+    timer->next = *pptr;
+    *pptr = timer;
+  } else {
+    CFRunLoopTimerContext context = { 0, timer, NULL, NULL, NULL };
+    
+    timer->cfTimer = CFRunLoopTimerCreate (kCFAllocatorDefault,
+                                           timer->fireTime,
+                                           0, 0, 0,
+                                           fire_cf_timer,
+                                           &context);
+    CFRunLoopAddTimer (CFRunLoopGetCurrent (), timer->cfTimer,
+                       kCFRunLoopCommonModes);
+  }
+  
+  return timer;
+}
+
+void
+vclock_cancel (vclock_timer_t timer)
+{
+  if (!timer)
+    return;
+  
+  if (timer->cfTimer) {
+    CFRunLoopTimerInvalidate (timer->cfTimer);
+    CFRelease (timer->cfTimer);
+  } else {
+    struct vclock_timer **pptr = &simulatedTimers;
+    
+    while (*pptr && *pptr != timer)
+      pptr = &(*pptr)->next;
+    
+    if (*pptr)
+      *pptr = timer->next;
+  }
+  
+  free (timer);
+}
+
+void
+vclock_advance (CFTimeInterval interval)
+{
+  CFAbsoluteTime target = simulatedNow + interval;
+  
+  if (!simulated)
+    return;
+  
+  /* Fire everything that falls due, in order, with the clock reading the
+     time each timer was due; callbacks may schedule further timers */
+  while (simulatedTimers && simulatedTimers->fireTime <= target) {
+    struct vclock_timer *timer = simulatedTimers;
+    
+    simulatedTimers = timer->next;
+    
+    if (timer->fireTime > simulatedNow)
+      simulatedNow = timer->fireTime;
+    
+    timer->callback (timer->info);
+    free (timer);
+  }
+  
+  simulatedNow = target;
+}
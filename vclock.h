@@ -0,0 +1,36 @@
+/*
+ *  vclock.h
+ *  staticrouted
+ *
+ *  Copyright 2010 Coriolis Systems Limited. All rights reserved.
+ *
+ */
+
+#ifndef VCLOCK_H_
+#define VCLOCK_H_
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <stdbool.h>
+
+/* All of the daemon's time queries and timers go through here.  Normally
+   they map straight onto CFAbsoluteTimeGetCurrent() and CFRunLoopTimer, but
+   in simulated mode time only moves when vclock_advance() is called, so
+   timer-driven behaviour can be exercised deterministically and faster than
+   real time. */
+
+typedef struct vclock_timer *vclock_timer_t;
+typedef void (*vclock_callback_t) (void *info);
+
+void vclock_use_simulated (CFAbsoluteTime start);
+bool vclock_is_simulated (void);
+
+CFAbsoluteTime vclock_now (void);
+
+vclock_timer_t vclock_schedule (CFTimeInterval delay,
+                                vclock_callback_t callback,
+                                void *info);
+void vclock_cancel (vclock_timer_t timer);
+
+void vclock_advance (CFTimeInterval interval);
+
+#endif /* VCLOCK_H_ */